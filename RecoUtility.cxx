@@ -1,5 +1,109 @@
 #include "MuonReco/RecoUtility.h"
+#include "muon_tracker.h"
+#include <TFile.h>
+#include <TTree.h>
+#include <algorithm>
 #include <iostream>
+#include <memory>
+
+namespace {
+
+  // === Live tracking: hand each event's hits to the tracking library in memory ===
+  // Enabled with LIVE_TRACKING. Tracks are found on worker threads next to decoding;
+  // the writer thread saves them to tracked_live.csv and monitoring snapshots go to
+  // live_monitor_*.csv. Drift radii use the rt_relation.root written by rt_rel_mon.py.
+  bool   LIVE_TRACKING         = false;
+  int    LIVE_TRACKING_THREADS = 2;
+  double LIVE_TRACKING_T0      = 489.624;
+
+  std::unique_ptr<MDTTracking::RTRelation> LoadRTRelation(const char* filename, double t0) {
+    TFile f(filename, "READ");
+    TTree* tree = f.IsOpen() ? dynamic_cast<TTree*>(f.Get("rt_tree")) : nullptr;
+    if (!tree) {
+      std::cout << "Live tracking: cannot read rt_tree from " << filename << std::endl;
+      return nullptr;
+    }
+    double time_ns = 0, radius_mm = 0;
+    tree->SetBranchAddress("time_ns",   &time_ns);
+    tree->SetBranchAddress("radius_mm", &radius_mm);
+    std::vector<double> times, radii;
+    for (Long64_t i = 0; i < tree->GetEntries(); i++) {
+      tree->GetEntry(i);
+      times.push_back(time_ns);
+      radii.push_back(radius_mm);
+    }
+    if (times.empty()) {
+      std::cout << "Live tracking: rt_tree in " << filename << " is empty" << std::endl;
+      return nullptr;
+    }
+    return std::make_unique<MDTTracking::RTRelation>(times, radii, t0);
+  }
+
+  struct LiveTracking {
+    std::unique_ptr<MDTTracking::RTRelation> rt;
+    MDTTracking::Monitor     monitor;
+    MDTTracking::TrackWriter writer;
+    std::unique_ptr<MDTTracking::MuonTracker> tracker;
+    int synced_snapshots = 0;
+
+    explicit LiveTracking(std::unique_ptr<MDTTracking::RTRelation> r)
+      : rt(std::move(r)), monitor("live_monitor", 100),
+        writer("tracked_live.csv", MDTTracking::TrackWriter::Format::CSV) {}
+
+    // Nothing is created (no output file, no worker threads) unless r(t) can be loaded.
+    static std::unique_ptr<LiveTracking> Create() {
+      auto rt = LoadRTRelation("rt_relation.root", LIVE_TRACKING_T0);
+      if (!rt) return nullptr;
+      auto live = std::make_unique<LiveTracking>(std::move(rt));
+      if (!live->writer.is_open()) {
+        std::cout << "Live tracking: cannot open tracked_live.csv" << std::endl;
+        return nullptr;
+      }
+      MDTTracking::TrackerConfig config;
+      config.n_workers = std::max(1, LIVE_TRACKING_THREADS);
+      config.monitor   = &live->monitor;
+      live->tracker = std::make_unique<MDTTracking::MuonTracker>(config);
+      return live;
+    }
+
+    ~LiveTracking() {
+      if (!tracker) return;
+      tracker->finish();
+      Drain();
+      monitor.snapshot();
+      writer.close();
+      std::cout << "Live tracking: " << tracker->n_tracks() << " tracks" << std::endl;
+    }
+
+    // Hand finished tracks to the writer; whenever a monitoring snapshot has been
+    // written, tracked_live.csv is brought up to date on disk as well.
+    void Drain() {
+      std::vector<MDTTracking::SavedHit> rows;
+      if (tracker->poll(rows)) writer.write(std::move(rows));
+      int snapshots = monitor.snapshots();
+      if (snapshots != synced_snapshots) {
+        writer.sync();
+        synced_snapshots = snapshots;
+      }
+    }
+  };
+
+  std::unique_ptr<LiveTracking> live_tracking;
+  bool live_tracking_started = false;
+
+  LiveTracking* GetLiveTracking() {
+    if (!live_tracking_started) {
+      live_tracking_started = true;
+      live_tracking = LiveTracking::Create();
+      if (!live_tracking) {
+        std::cout << "Live tracking: disabled" << std::endl;
+        LIVE_TRACKING = false;
+      }
+    }
+    return live_tracking.get();
+  }
+
+}
 
 namespace MuonReco {
 
@@ -42,12 +146,23 @@ namespace MuonReco {
 
     SIG_VOLTAGE_INVERT  = ps.getInt   ("SIG_VOLTAGE_INVERT",  0,        0);
     TRG_VOLTAGE_INVERT  = ps.getInt   ("TRG_VOLTAGE_INVERT",  0,        0);
+
+    LIVE_TRACKING         = ps.getBool  ("LIVE_TRACKING",         0,       0);
+    LIVE_TRACKING_THREADS = ps.getInt   ("LIVE_TRACKING_THREADS", 2,       0);
+    LIVE_TRACKING_T0      = ps.getDouble("LIVE_TRACKING_T0",      489.624, 0);
     std::cout<<"Configure IS_PHASE2_DATA="<<IS_PHASE2_DATA<<std::endl;
     std::cout<<"Configure ADC_NOISE_CUT="<<ADC_NOISE_CUT<<std::endl;
   }
 
   bool RecoUtility::IsPhase2Data(){return IS_PHASE2_DATA;}
 
+  // End of run: finish the queued events, write the last snapshot and close
+  // tracked_live.csv. The next event with LIVE_TRACKING set starts a new live tracking.
+  void RecoUtility::FinishLiveTracking() {
+    live_tracking.reset();
+    live_tracking_started = false;
+  }
+
   bool RecoUtility::CheckEvent(Event e, int* status) {
     
     // need precisely one trigger for data
@@ -247,6 +362,8 @@ namespace MuonReco {
     int layer, column;
     double hx, hy;
     int nhits = 0;
+    LiveTracking* live = LIVE_TRACKING ? GetLiveTracking() : nullptr;
+    std::vector<MDTTracking::Hit> live_hits;
     for (auto sig : e->WireSignals()) {
       adc_time = sig.Width()*BINSIZE*WIDTHSEL;
       if(adc_time>=adc_cut){
@@ -269,6 +386,12 @@ namespace MuonReco {
         e->AddSignalHit(h);
         nhits++;
 
+        if (live) {
+          live_hits.push_back({static_cast<int>(sig.TDC()), static_cast<int>(sig.Channel()),
+                               static_cast<int>(sig.HeaderEID()), static_cast<int>(sig.TriggerLEdge()),
+                               drift_time, adc_time, corr_time, live->rt->radius(drift_time)});
+        }
+
 	// === DEBUG: dump event_id and TDC to CSV in chunks of 1m hits ===
         static std::ofstream debugCSV;
         static long long debugHitCounter = 0;
@@ -293,6 +416,11 @@ namespace MuonReco {
         }
       } //if(adc_time>=adc_cut)
     } //for (auto sig : e->Signals())
+
+    if (live) {
+      live->tracker->push_event(std::move(live_hits));
+      live->Drain();
+    }
     return nhits;
   }
 } 
@@ -0,0 +1,1432 @@
+// muon_tracker.cpp
+// Implementation of the MDT tracking library declared in muon_tracker.h.
+
+#include "muon_tracker.h"
+
+#include <bits/stdc++.h>
+#include <glob.h>
+using namespace std;
+
+namespace MDTTracking {
+
+const vector<array<Point,24>> &tdc_geometry() {
+    static const vector<array<Point,24>> geometry_tdcs = [] {
+        // geometry setup (cm -> mm)
+        map<int, Point> geometry_layer = {
+            {0,{1.5,1.5}},{1,{4.5,1.5}},{2,{7.5,1.5}},{3,{10.5,1.5}},
+            {4,{13.5,1.5}},{5,{16.5,1.5}},{6,{19.5,1.5}},{7,{22.5,1.5}},
+            {8,{3.0,4.1}},{9,{6.0,4.1}},{10,{9.0,4.1}},{11,{12.0,4.1}},
+            {12,{15.0,4.1}},{13,{18.0,4.1}},{14,{21.0,4.1}},{15,{24.0,4.1}},
+            {16,{1.5,6.7}},{17,{4.5,6.7}},{18,{7.5,6.7}},{19,{10.5,6.7}},
+            {20,{13.5,6.7}},{21,{16.5,6.7}},{22,{19.5,6.7}},{23,{22.5,6.7}}
+        };
+        vector<pair<double,double>> tdc_offsets = {
+            {-96.0,0}, {-96.0,34.7}, {-72.0,0}, {-72.0,34.7},
+            {-48.0,0}, {-48.0,34.7}, {-24.0,0}, {-24.0,34.7},
+            {0.0,0.0}, {0.0,34.7}, {24.0,0.0}, {24.0,34.7},
+            {48.0,0.0}, {48.0,34.7}, {72.0,0.0}, {72.0,34.7},
+            {96.0,0.0}, {96.0,34.7}
+        };
+        vector<array<Point,24>> geo;
+        geo.resize(tdc_offsets.size());
+        for (size_t tid=0; tid<tdc_offsets.size(); ++tid) {
+            double dx = tdc_offsets[tid].first;
+            double dy = tdc_offsets[tid].second;
+            for (int ch=0; ch<24; ++ch) {
+                auto p = geometry_layer[ch];
+                double xmm = (p.first + dx) * 10.0;
+                double ymm = (p.second + dy) * 10.0;
+                geo[tid][ch] = {xmm,ymm};
+            }
+        }
+        return geo;
+    }();
+    return geometry_tdcs;
+}
+
+static const vector<pair<int,int>> tdc_pairs = {
+    {0,1},{2,3},{4,5},{6,7},{8,9},
+    {10,11},{12,13},{14,15},{16,17}
+};
+
+// helper: least-squares tangency solver using normal equations (3x3)
+// over the first n points
+static bool fit_tangent_line(const array<double,6> &xs,
+                             const array<double,6> &ys,
+                             const array<double,6> &rs,
+                             double &out_a, double &out_b, double &out_c, int n = 6)
+{
+    double ATA[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
+    double ATB[3] = {0,0,0};
+    for (int i=0;i<n;++i) {
+        double xi = xs[i], yi = ys[i], ri = rs[i];
+        ATA[0][0] += xi*xi; ATA[0][1] += xi*yi; ATA[0][2] += xi;
+        ATA[1][0] += yi*xi; ATA[1][1] += yi*yi; ATA[1][2] += yi;
+        ATA[2][0] += xi;     ATA[2][1] += yi;     ATA[2][2] += 1.0;
+        ATB[0] += xi * ri;
+        ATB[1] += yi * ri;
+        ATB[2] += 1.0 * ri;
+    }
+    double det = ATA[0][0]*(ATA[1][1]*ATA[2][2]-ATA[1][2]*ATA[2][1])
+               - ATA[0][1]*(ATA[1][0]*ATA[2][2]-ATA[1][2]*ATA[2][0])
+               + ATA[0][2]*(ATA[1][0]*ATA[2][1]-ATA[1][1]*ATA[2][0]);
+    if (fabs(det) < 1e-12) return false;
+    double M[3][4];
+    for (int i=0;i<3;++i) {
+        for (int j=0;j<3;++j) M[i][j] = ATA[i][j];
+        M[i][3] = ATB[i];
+    }
+    for (int i=0;i<3;++i) {
+        int piv = i;
+        for (int r=i+1;r<3;++r) if (fabs(M[r][i]) > fabs(M[piv][i])) piv = r;
+        if (fabs(M[piv][i]) < 1e-15) return false;
+        if (piv!=i) for (int c=i;c<4;++c) swap(M[i][c], M[piv][c]);
+        double div = M[i][i];
+        for (int c=i;c<4;++c) M[i][c] /= div;
+        for (int r=0;r<3;++r) if (r!=i) {
+            double fac = M[r][i];
+            for (int c=i;c<4;++c) M[r][c] -= fac * M[i][c];
+        }
+    }
+    double sol[3] = { M[0][3], M[1][3], M[2][3] };
+    double a = sol[0], b = sol[1], c = sol[2];
+    double norm = sqrt(a*a + b*b);
+    if (norm == 0.0) return false;
+    out_a = a / norm;
+    out_b = b / norm;
+    out_c = c / norm;
+    return true;
+}
+
+static double distance_point_line(double a,double b,double c,double x0,double y0) {
+    return fabs(a*x0 + b*y0 + c);
+}
+
+int rollover_bindiff_cal(int a, int b, int rollover) {
+    int bindiff;
+    bindiff = a-b;
+    if (bindiff > rollover/2)   bindiff -= rollover;
+    else if (bindiff < - (rollover/2)) bindiff += rollover;
+    return bindiff;
+}
+
+bool load_hits_csv(const string &path, vector<Hit> &out,
+                   const function<bool(const Hit&)> &keep_reading)
+{
+    ifstream fin(path);
+    if (!fin.is_open()) {
+        cerr << "Failed to open " << path << "\n";
+        return false;
+    }
+
+    // read header, find indices
+    string header;
+    if (!getline(fin, header)) {
+        cerr << "Empty CSV " << path << "\n";
+        return false;
+    }
+    vector<string> cols;
+    {
+        string cur;
+        stringstream ss(header);
+        while (getline(ss, cur, ',')) {
+            while (!cur.empty() && isspace((unsigned char)cur.back())) cur.pop_back();
+            while (!cur.empty() && isspace((unsigned char)cur.front())) cur.erase(cur.begin());
+            cols.push_back(cur);
+        }
+    }
+    auto find_col = [&](const string &name)->int {
+        for (size_t i=0;i<cols.size();++i){
+            string low = cols[i];
+            for (auto &c: low) c = tolower((unsigned char)c);
+            string n = name;
+            for (auto &c: n) c = tolower((unsigned char)c);
+            if (low == n) return (int)i;
+        }
+        for (size_t i=0;i<cols.size();++i){
+            string low = cols[i];
+            for (auto &c: low) c = tolower((unsigned char)c);
+            string n = name;
+            for (auto &c: n) c = tolower((unsigned char)c);
+            if (low.find(n) != string::npos) return (int)i;
+        }
+        return -1;
+    };
+
+    int idx_TDCID = find_col("TDCID");
+    int idx_CHNLID = find_col("CHNLID");
+    int idx_eventid = find_col("eventid");
+    int idx_triggerledge = find_col("triggerledge");
+    int idx_drift = find_col("drift_radius");
+    double idx_drift_time = find_col("drift_time");
+    double idx_corr_time = find_col("corr_time");
+    double idx_adc_time = find_col("adc_time");
+    if (idx_drift == -1) idx_drift = find_col("driftradius");
+    if (idx_drift == -1) idx_drift = find_col("drift_radius_mm");
+
+    if (idx_TDCID<0 || idx_CHNLID<0 || idx_eventid<0 || idx_triggerledge<0 || idx_drift<0) {
+        cerr << "Required columns not found in " << path << ". Found header columns:\n";
+        for (auto &c: cols) cerr << c << " | ";
+        cerr << "\nNeed TDCID, CHNLID, eventid, triggerledge, drift_radius (or similar)\n";
+        return false;
+    }
+
+    // parse CSV into vector<Hit>
+    string line;
+    int line_no = 1;
+    while (getline(fin, line)) {
+        ++line_no;
+        if (line.empty()) continue;
+        vector<string> tokens;
+        string cur;
+        stringstream ss(line);
+        while (getline(ss, cur, ',')) tokens.push_back(cur);
+        if ((int)tokens.size() < (int)cols.size()) tokens.resize(cols.size());
+        try {
+            Hit h;
+            h.TDCID = stoi(tokens[idx_TDCID]);
+            h.CHNLID = stoi(tokens[idx_CHNLID]);
+            h.eventid = stoi(tokens[idx_eventid]);
+            h.triggerledge = stoi(tokens[idx_triggerledge]);
+            h.drift_radius = stod(tokens[idx_drift]);
+	    h.drift_time = stod(tokens[idx_drift_time]);
+	    h.corr_time = stod(tokens[idx_corr_time]);
+	    h.adc_time = stod(tokens[idx_adc_time]);
+            if (keep_reading && !keep_reading(h)) break;
+            out.push_back(h);
+        } catch (...) {
+            cerr << "Warning: cannot parse line " << line_no << " of " << path << " -> skipping\n";
+            continue;
+        }
+    }
+    fin.close();
+    return true;
+}
+
+// ------------------------------------------------------------
+// RT RELATION
+// ------------------------------------------------------------
+RTRelation::RTRelation(vector<double> time_ns, vector<double> radius_mm, double t0) : t0_(t0) {
+    vector<size_t> order(min(time_ns.size(), radius_mm.size()));
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&](size_t l, size_t r) { return time_ns[l] < time_ns[r]; });
+    for (size_t i : order) {
+        time_.push_back(time_ns[i]);
+        radius_.push_back(radius_mm[i]);
+    }
+}
+
+double RTRelation::radius(double drift_time) const {
+    if (time_.empty()) return 0.0;
+    double t = drift_time - t0_;
+    if (t <= time_.front()) return radius_.front();
+    if (t >= time_.back()) return radius_.back();
+    size_t i = upper_bound(time_.begin(), time_.end(), t) - time_.begin();
+    double f = (t - time_[i-1]) / (time_[i] - time_[i-1]);
+    return radius_[i-1] + f * (radius_[i] - radius_[i-1]);
+}
+
+// ------------------------------------------------------------
+// HOT / NOISY CHANNEL MASKING
+// ------------------------------------------------------------
+ChannelMasker::ChannelMasker(Action action, double hot_factor, uint64_t min_hits, double dead_time, int horizon)
+    : action_(action), hot_factor_(hot_factor), min_hits_(min_hits),
+      dead_time_(dead_time), horizon_(max(1, horizon)) {}
+
+void ChannelMasker::count(const vector<Hit> &hits) {
+    lock_guard<mutex> lock(mutex_);
+    for (auto &h : hits) counts_[key(h.TDCID, h.CHNLID)]++;
+}
+
+void ChannelMasker::push_window(const vector<Hit> &hits) {
+    unordered_map<int, uint64_t> win;
+    for (auto &h : hits) win[key(h.TDCID, h.CHNLID)]++;
+    lock_guard<mutex> lock(mutex_);
+    for (auto &kv : win) counts_[kv.first] += kv.second;
+    history_.push_back(std::move(win));
+    if ((int)history_.size() > horizon_) {
+        for (auto &kv : history_.front()) counts_[kv.first] -= kv.second;
+        history_.pop_front();
+    }
+    decide_locked();
+}
+
+void ChannelMasker::decide() {
+    lock_guard<mutex> lock(mutex_);
+    decide_locked();
+}
+
+void ChannelMasker::decide_locked() {
+    vector<uint64_t> occ;
+    for (auto &kv : counts_) if (kv.second > 0) occ.push_back(kv.second);
+    if (occ.empty()) return;
+    nth_element(occ.begin(), occ.begin() + occ.size()/2, occ.end());
+    double median = (double)occ[occ.size()/2];
+
+    map<int, Decision> next;
+    for (auto &kv : counts_) {
+        double ratio = kv.second / median;
+        if (kv.second < min_hits_ || ratio <= hot_factor_) continue;
+        next[kv.first] = {action_, kv.second, ratio};
+    }
+    for (auto &kv : next) {
+        if (decisions_.count(kv.first)) continue;
+        log_decision(kv.first, kv.second, median);
+        auto &ever = flagged_[kv.first];
+        if (kv.second.hits >= ever.hits) ever = kv.second;
+    }
+    for (auto &kv : decisions_) {
+        if (next.count(kv.first)) continue;
+        cout << "[mask] TDC " << kv.first/64 << " CH " << kv.first%64 << ": occupancy back to normal -> released\n";
+    }
+    decisions_.swap(next);
+}
+
+size_t ChannelMasker::apply(vector<Hit> &hits, size_t n_own) {
+    map<int, Decision> decisions;
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (decisions_.empty()) return 0;
+        decisions = decisions_;
+    }
+    unordered_map<int, size_t> last_kept; // tube -> index in kept
+    vector<Hit> kept;
+    kept.reserve(hits.size());
+    size_t removed = 0;
+    for (size_t i=0; i<hits.size(); ++i) {
+        const Hit &h = hits[i];
+        auto it = decisions.find(key(h.TDCID, h.CHNLID));
+        if (it != decisions.end()) {
+            bool drop = it->second.action == Action::MASK;
+            auto lk = last_kept.find(it->first);
+            if (!drop && lk != last_kept.end()) {
+                const Hit &prev = kept[lk->second];
+                drop = prev.eventid == h.eventid && prev.triggerledge == h.triggerledge &&
+                       fabs(h.drift_time - prev.drift_time) < dead_time_;
+            }
+            if (drop) {
+                if (i < n_own) ++removed;
+                continue;
+            }
+            last_kept[it->first] = kept.size();
+        }
+        kept.push_back(h);
+    }
+    hits.swap(kept);
+    removed_ += removed;
+    return removed;
+}
+
+bool ChannelMasker::load(const string &path) {
+    ifstream fin(path);
+    if (!fin.is_open()) { cerr << "Failed to open mask file " << path << "\n"; return false; }
+    lock_guard<mutex> lock(mutex_);
+    string line;
+    while (getline(fin, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        stringstream ss(line);
+        string tdc, ch, act, hits, ratio;
+        getline(ss, tdc, ','); getline(ss, ch, ','); getline(ss, act, ',');
+        getline(ss, hits, ','); getline(ss, ratio, ',');
+        try {
+            Decision d;
+            d.action = (act == "collapse") ? Action::COLLAPSE : Action::MASK;
+            d.hits = hits.empty() ? 0 : stoull(hits);
+            d.ratio = ratio.empty() ? 0.0 : stod(ratio);
+            int k = key(stoi(tdc), stoi(ch));
+            decisions_[k] = d;
+            flagged_[k] = d;
+            cout << "[mask] TDC " << tdc << " CH " << ch << ": from " << path << " -> "
+                 << action_name(d.action) << "\n";
+        } catch (...) {
+            cerr << "Warning: cannot parse mask line '" << line << "' -> skipping\n";
+        }
+    }
+    return true;
+}
+
+bool ChannelMasker::save(const string &path) const {
+    ofstream fout(path);
+    if (!fout.is_open()) { cerr << "Cannot open mask file " << path << "\n"; return false; }
+    lock_guard<mutex> lock(mutex_);
+    fout << "# TDCID,CHNLID,action,hits,ratio\n";
+    for (auto &kv : flagged_) {
+        fout << kv.first/64 << "," << kv.first%64 << "," << action_name(kv.second.action) << ","
+             << kv.second.hits << "," << kv.second.ratio << "\n";
+    }
+    cout << "[mask] wrote " << flagged_.size() << " channels to " << path << "\n";
+    return true;
+}
+
+const char *ChannelMasker::action_name(Action a) {
+    return a == Action::COLLAPSE ? "collapse" : a == Action::MASK ? "mask" : "none";
+}
+
+void ChannelMasker::log_decision(int k, const Decision &d, double median) const {
+    cout << "[mask] TDC " << k/64 << " CH " << k%64 << ": " << d.hits << " hits ("
+         << d.ratio << "x median " << median << ") -> " << action_name(d.action) << "\n";
+}
+
+// ------------------------------------------------------------
+// ONLINE MONITORING
+// ------------------------------------------------------------
+void merge_probe(EfficiencyProbes &probes, const string &key, const EfficiencyProbe &p) {
+    auto it = probes.find(key);
+    if (it == probes.end()) probes.emplace(key, p);
+    else if (p.chi2ndf < it->second.chi2ndf) it->second = p;
+}
+
+void MonitorHistograms::add_tracks(const vector<SavedHit> &rows)
+{
+    for (size_t t=0; t+6<=rows.size(); t+=6) {
+        ++n_tracks;
+        chi2ndf[min(CHI2_BINS-1, (int)(rows[t].chi2ndf / CHI2NDF_CUT * CHI2_BINS))]++;
+
+        for (size_t i=t; i<t+6; ++i) {
+            int rb = (int)(rows[i].drift_radius / R_MAX * R_BINS);
+            if (rb < 0 || rb >= R_BINS) continue;
+            double res = rows[i].residual;
+            res_n[rb]++;
+            res_sum[rb] += res;
+            res_sum2[rb] += res*res;
+            int eb = (int)floor((res + RES_MAX) / (2*RES_MAX) * RES_BINS);
+            if (eb >= 0 && eb < RES_BINS) res_vs_r[rb*RES_BINS + eb]++;
+        }
+    }
+}
+
+void MonitorHistograms::add_probes(const EfficiencyProbes &probes)
+{
+    for (auto &kv : probes) {
+        expected[kv.second.tube]++;
+        if (kv.second.found) found[kv.second.tube]++;
+    }
+}
+
+void MonitorHistograms::add(const MonitorHistograms &o) {
+    for (size_t i=0;i<expected.size();++i) { expected[i] += o.expected[i]; found[i] += o.found[i]; }
+    for (size_t i=0;i<res_vs_r.size();++i) res_vs_r[i] += o.res_vs_r[i];
+    for (int i=0;i<R_BINS;++i) { res_n[i] += o.res_n[i]; res_sum[i] += o.res_sum[i]; res_sum2[i] += o.res_sum2[i]; }
+    for (int i=0;i<CHI2_BINS;++i) chi2ndf[i] += o.chi2ndf[i];
+    n_tracks += o.n_tracks;
+}
+
+Monitor::Monitor(const string &prefix, int every) : prefix_(prefix), every_(max(1, every)) {}
+
+void Monitor::merge(MonitorHistograms &local) {
+    lock_guard<mutex> lock(mutex_);
+    total_.add(local);
+    local = MonitorHistograms();
+    if (++windows_ % every_ == 0) write_snapshot();
+}
+
+void Monitor::snapshot() {
+    lock_guard<mutex> lock(mutex_);
+    if (windows_ == snapshot_windows_) return;
+    write_snapshot();
+}
+
+int Monitor::snapshots() {
+    lock_guard<mutex> lock(mutex_);
+    return snapshots_;
+}
+
+void Monitor::write_snapshot() {
+    const auto &m = total_;
+    uint64_t exp_sum = 0, found_sum = 0;
+
+    ofstream ftubes(prefix_ + "_tubes.csv");
+    ftubes << "TDCID,CHNLID,expected,found,efficiency\n";
+    for (int tdc=0; tdc<MonitorHistograms::N_TDC; ++tdc) {
+        for (int ch=0; ch<MonitorHistograms::N_CH; ++ch) {
+            int k = tdc*MonitorHistograms::N_CH + ch;
+            exp_sum += m.expected[k]; found_sum += m.found[k];
+            if (m.expected[k] == 0) continue;
+            ftubes << tdc << "," << ch << "," << m.expected[k] << "," << m.found[k] << ","
+                   << (double)m.found[k] / m.expected[k] << "\n";
+        }
+    }
+
+    ofstream fres(prefix_ + "_resolution.csv");
+    fres << "r_low,r_high,n,mean,rms";
+    for (int e=0; e<MonitorHistograms::RES_BINS; ++e)
+        fres << ",res_" << (-MonitorHistograms::RES_MAX + e * 2*MonitorHistograms::RES_MAX / MonitorHistograms::RES_BINS);
+    fres << "\n";
+    for (int r=0; r<MonitorHistograms::R_BINS; ++r) {
+        double bw = MonitorHistograms::R_MAX / MonitorHistograms::R_BINS;
+        uint64_t n = m.res_n[r];
+        double mean = n ? m.res_sum[r] / n : 0.0;
+        double rms = n ? sqrt(max(0.0, m.res_sum2[r] / n - mean*mean)) : 0.0;
+        fres << r*bw << "," << (r+1)*bw << "," << n << "," << mean << "," << rms;
+        for (int e=0; e<MonitorHistograms::RES_BINS; ++e) fres << "," << m.res_vs_r[r*MonitorHistograms::RES_BINS + e];
+        fres << "\n";
+    }
+
+    ofstream fchi2(prefix_ + "_chi2ndf.csv");
+    fchi2 << "chi2ndf_low,chi2ndf_high,n\n";
+    for (int i=0; i<MonitorHistograms::CHI2_BINS; ++i) {
+        double bw = CHI2NDF_CUT / MonitorHistograms::CHI2_BINS;
+        fchi2 << i*bw << "," << (i+1)*bw << "," << m.chi2ndf[i] << "\n";
+    }
+
+    ++snapshots_;
+    snapshot_windows_ = windows_;
+    cout << "[monitor] snapshot " << snapshots_ << " after " << windows_ << " windows: "
+         << m.n_tracks << " tracks, tube efficiency "
+         << (exp_sum ? (double)found_sum / exp_sum : 0.0) << " (" << found_sum << "/" << exp_sum << ")\n";
+}
+
+// ------------------------------------------------------------
+// EVENT BUILDER
+// ------------------------------------------------------------
+void EventBuilder::push(const Hit &h, vector<vector<Hit>> &done) {
+    for (auto it = open_.rbegin(); it != open_.rend(); ++it) {
+        if (it->eventid == h.eventid &&
+            abs(rollover_bindiff_cal(h.triggerledge, it->triggerledge, ROLLOVER)) <= EVENT_TRIGGER_TOLERANCE) {
+            it->hits.push_back(h);
+            return;
+        }
+    }
+    open_.push_back({h.eventid, h.triggerledge, {h}});
+    if ((int)open_.size() > EVENT_REORDER_DEPTH) {
+        done.push_back(std::move(open_.front().hits));
+        open_.pop_front();
+    }
+}
+
+void EventBuilder::flush(vector<vector<Hit>> &done) {
+    for (auto &ev : open_) done.push_back(std::move(ev.hits));
+    open_.clear();
+}
+
+// ------------------------------------------------------------
+// TRACK FINDING
+// ------------------------------------------------------------
+// Leave-one-layer-out efficiency probes (see EfficiencyProbe) for the hits of one
+// window, using the same tube columns and sign patterns as the track search.
+static void find_efficiency_probes(const ChannelHitMap &map_hits, EfficiencyProbes &probes)
+{
+    const auto &geometry_tdcs = tdc_geometry();
+    static const vector<const Hit*> no_hits;
+    auto tube_hits = [&](int tdc, int ch) -> const vector<const Hit*>& {
+        auto t = map_hits.find(tdc);
+        if (t == map_hits.end()) return no_hits;
+        auto c = t->second.find(ch);
+        return c == t->second.end() ? no_hits : c->second;
+    };
+
+    for (int iteration=1; iteration<=2; ++iteration) {
+        array<int,3> layer_offsets;
+        array<double,6> signs;
+        if (iteration==1) {
+            layer_offsets = {0,8,16};
+            signs = {+1.0, -1.0, +1.0, +1.0, -1.0, +1.0};
+        } else {
+            layer_offsets = {0,7,16};
+            signs = {-1.0, +1.0, -1.0, -1.0, +1.0, -1.0};
+        }
+
+        for (auto &pair_tdcs : tdc_pairs) {
+            if (map_hits.find(pair_tdcs.first)==map_hits.end() || map_hits.find(pair_tdcs.second)==map_hits.end()) continue;
+            for (int base=0; base<8; ++base) {
+                // the probe needs one tube per layer: bottom 0-7, middle 8-15, top 16-23
+                if ((base + layer_offsets[1]) / 8 != 1) continue;
+                array<int,6> tdcs, chs;
+                array<const vector<const Hit*>*,6> lists;
+                int n_empty = 0;
+                for (int i=0;i<6;++i) {
+                    tdcs[i] = i < 3 ? pair_tdcs.first : pair_tdcs.second;
+                    chs[i] = base + layer_offsets[i % 3];
+                    lists[i] = &tube_hits(tdcs[i], chs[i]);
+                    if (lists[i]->empty()) ++n_empty;
+                }
+                if (n_empty > 1) continue;
+
+                for (int test=0; test<6; ++test) {
+                    int n_other_empty = n_empty - (lists[test]->empty() ? 1 : 0);
+                    if (n_other_empty > 0) continue;
+                    array<int,5> layers;
+                    for (int i=0, k=0; i<6; ++i) if (i != test) layers[k++] = i;
+                    int key_layer = test == 5 ? 2 : 5; // top hit of the candidate
+                    int test_layer = chs[test] / 8;
+                    auto &geo_test = geometry_tdcs[tdcs[test]];
+
+                    // cartesian product over the 5 other layers
+                    array<size_t,5> idx = {0,0,0,0,0};
+                    for (;;) {
+                        array<double,6> xs, ys, rs;
+                        const Hit *key_hit = (*lists[key_layer])[idx[key_layer < test ? key_layer : key_layer-1]];
+                        bool same_trigger = true;
+                        for (int k=0;k<5;++k) {
+                            int i = layers[k];
+                            const Hit *ph = (*lists[i])[idx[k]];
+                            Point p = geometry_tdcs[tdcs[i]][chs[i]];
+                            xs[k] = p.first;
+                            ys[k] = p.second;
+                            rs[k] = ph->drift_radius * signs[i];
+                            if (ph->eventid != key_hit->eventid || ph->triggerledge != key_hit->triggerledge) same_trigger = false;
+                        }
+                        double a,b,c;
+                        // only candidates of one trigger can tell whether its test tube fired
+                        if (same_trigger && fit_tangent_line(xs, ys, rs, a,b,c, 5)) {
+                            double chi2 = 0.0;
+                            for (int k=0;k<5;++k) {
+                                double res = distance_point_line(a,b,c,xs[k],ys[k]) - fabs(rs[k]);
+                                chi2 += res*res;
+                            }
+                            double chi2ndf = chi2 / (5 - 3);
+                            // tube of the test layer nearest to the candidate
+                            int best_ch = -1;
+                            double best_d = TUBE_INNER_RADIUS;
+                            for (int ch=test_layer*8; ch<test_layer*8+8; ++ch) {
+                                double d = distance_point_line(a,b,c,geo_test[ch].first,geo_test[ch].second);
+                                if (d < best_d) { best_d = d; best_ch = ch; }
+                            }
+                            if (chi2ndf <= CHI2NDF_CUT && best_ch >= 0) {
+                                bool found = false;
+                                for (const Hit *h : tube_hits(tdcs[test], best_ch)) {
+                                    if (h->eventid == key_hit->eventid && h->triggerledge == key_hit->triggerledge &&
+                                        fabs(h->drift_radius - best_d) < EFF_RADIUS_TOLERANCE) { found = true; break; }
+                                }
+                                string key = to_string(key_hit->TDCID) + "_" + to_string(key_hit->CHNLID) + "_" +
+                                             to_string(key_hit->eventid) + "_" + to_string(key_hit->triggerledge) + "_" +
+                                             to_string(tdcs[test]) + "_" + to_string(test_layer);
+                                merge_probe(probes, key, {tdcs[test]*MonitorHistograms::N_CH + best_ch, found, chi2ndf});
+                            }
+                        }
+                        int k = 4;
+                        while (k >= 0 && ++idx[k] == lists[layers[k]]->size()) idx[k--] = 0;
+                        if (k < 0) break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+int track_window(const vector<Hit> &window_hits, vector<SavedHit> &out_rows,
+                 int &track_id, bool verbose, EfficiencyProbes *probes,
+                 size_t best_buckets)
+{
+    const auto &geometry_tdcs = tdc_geometry();
+
+    ChannelHitMap map_hits;
+    map_hits.reserve(32);
+    for (auto &h: window_hits) {
+        map_hits[h.TDCID][h.CHNLID].push_back(&h);
+    }
+    if (probes) find_efficiency_probes(map_hits, *probes);
+
+    // GLOBAL best per top-layer hit across both iterations for this window
+    struct BestFit {
+        array<const Hit*,6> tube_ptrs;
+        array<double,6> xs;
+        array<double,6> ys;
+        array<double,6> residuals;
+        double a,b,c;
+        double chi2ndf;
+    };
+    unordered_map<string, BestFit> global_best_top_map;
+    global_best_top_map.reserve(best_buckets);
+
+    // Two iterations
+    for (int iteration=1; iteration<=2; ++iteration) {
+        array<int,3> layer_offsets;
+        array<double,6> signs;
+        if (iteration==1) {
+            layer_offsets = {0,8,16};
+            signs = {+1.0, -1.0, +1.0, +1.0, -1.0, +1.0};
+        } else {
+            layer_offsets = {0,7,16};
+            signs = {-1.0, +1.0, -1.0, -1.0, +1.0, -1.0};
+        }
+
+        for (auto &pair_tdcs : tdc_pairs) {
+            int t0 = pair_tdcs.first;
+            int t1 = pair_tdcs.second;
+            if (map_hits.find(t0)==map_hits.end() || map_hits.find(t1)==map_hits.end()) continue;
+            auto &chmapA = map_hits[t0];
+            auto &chmapB = map_hits[t1];
+
+            for (int base=0; base<8; ++base) {
+                int chA_bot = base + layer_offsets[0];
+                int chA_med = base + layer_offsets[1];
+                int chA_top = base + layer_offsets[2];
+                int chB_bot = chA_bot;
+                int chB_med = chA_med;
+                int chB_top = chA_top;
+
+                if (chmapA.find(chA_bot)==chmapA.end() || chmapA.find(chA_med)==chmapA.end() || chmapA.find(chA_top)==chmapA.end()) continue;
+                if (chmapB.find(chB_bot)==chmapB.end() || chmapB.find(chB_med)==chmapB.end() || chmapB.find(chB_top)==chmapB.end()) continue;
+
+                auto &arrA_bot = chmapA[chA_bot];
+                auto &arrA_med = chmapA[chA_med];
+                auto &arrA_top = chmapA[chA_top];
+                auto &arrB_bot = chmapB[chB_bot];
+                auto &arrB_med = chmapB[chB_med];
+                auto &arrB_top = chmapB[chB_top];
+
+                auto &geoA = geometry_tdcs[t0];
+                auto &geoB = geometry_tdcs[t1];
+
+                // nested loops (cartesian product)
+                for (const Hit* hA_top : arrA_top) {
+                    for (const Hit* hB_top : arrB_top) {
+                        for (const Hit* hA_bot : arrA_bot) {
+                            for (const Hit* hA_med : arrA_med) {
+                                for (const Hit* hB_bot : arrB_bot) {
+                                    for (const Hit* hB_med : arrB_med) {
+                                        array<const Hit*,6> tube_ptrs = {hA_bot, hA_med, hA_top, hB_bot, hB_med, hB_top};
+                                        array<double,6> xs, ys, rs;
+                                        for (int i=0;i<6;++i) {
+                                            const Hit* ph = tube_ptrs[i];
+                                            int tdc = ph->TDCID;
+                                            int ch = ph->CHNLID;
+                                            Point p = (tdc==t0) ? geoA[ch] : geoB[ch];
+                                            xs[i] = p.first;
+                                            ys[i] = p.second;
+                                            rs[i] = ph->drift_radius * signs[i];
+                                        }
+                                        double a,b,c;
+                                        bool ok = fit_tangent_line(xs, ys, rs, a,b,c);
+                                        if (!ok) continue;
+                                        array<double,6> residuals;
+                                        double chi2 = 0.0;
+                                        for (int i=0;i<6;++i) {
+                                            double d = distance_point_line(a,b,c,xs[i],ys[i]);
+                                            double res = d - fabs(rs[i]);
+                                            residuals[i] = res;
+                                            chi2 += res*res;
+                                        }
+                                        double ndf = 6 - 3;
+                                        double chi2ndf = chi2 / ndf;
+                                        if (chi2ndf > CHI2NDF_CUT) continue;
+
+                                        // canonical top key: ONLY identify by the top even hit properties (tdc,ch,eventid,triggerledge)
+                                        string key = to_string(hA_top->TDCID) + "_" + to_string(hA_top->CHNLID) + "_" +
+                                                     to_string(hA_top->eventid) + "_" + to_string(hA_top->triggerledge);
+
+                                        auto it = global_best_top_map.find(key);
+                                        if (it == global_best_top_map.end() || chi2ndf < it->second.chi2ndf) {
+                                            BestFit bf;
+                                            bf.tube_ptrs = tube_ptrs;
+                                            bf.xs = xs; bf.ys = ys; bf.residuals = residuals;
+                                            bf.a = a; bf.b = b; bf.c = c; bf.chi2ndf = chi2ndf;
+                                            global_best_top_map[key] = std::move(bf);
+                                        }
+                                    }
+                                }
+                            }
+                        }
+                    }
+                } // end product
+            } // end base
+        } // end tdc_pairs
+    } // end two iterations
+
+    // Save global bests for this window (one entry per top_key)
+    int saved = 0;
+    for (auto &kv : global_best_top_map) {
+        auto &bf = kv.second;
+        double tavg = 0.0;
+        for (int i=0;i<6;++i) tavg += bf.tube_ptrs[i]->triggerledge;
+        tavg /= 6.0;
+        for (int i=0;i<6;++i) {
+            const Hit* ph = bf.tube_ptrs[i];
+            SavedHit sh;
+            sh.track_id = track_id;
+            sh.TDCID = ph->TDCID;
+            sh.CHNLID = ph->CHNLID;
+            sh.eventid = ph->eventid;
+		sh.drift_time = ph->drift_time;
+		sh.corr_time = ph->corr_time;
+		sh.adc_time = ph->adc_time;
+            sh.triggerledge = ph->triggerledge;
+            sh.Dt = ph->triggerledge - tavg;
+            sh.x = bf.xs[i];
+            sh.y = bf.ys[i];
+            sh.drift_radius = ph->drift_radius;
+            sh.residual = bf.residuals[i];
+            sh.a = bf.a; sh.b = bf.b; sh.c = bf.c;
+            sh.chi2ndf = bf.chi2ndf;
+            out_rows.push_back(sh);
+        }
+        if (verbose) cout << "    Saved BEST track " << track_id << " χ2/ndf=" << bf.chi2ndf << "\n";
+        ++track_id;
+        ++saved;
+    }
+    return saved;
+}
+
+void track_hits(const vector<Hit> &all_hits, vector<SavedHit> &out_rows,
+                int &track_id, bool verbose, Monitor *monitor,
+                ChannelMasker *rolling_mask,
+                const function<void(vector<SavedHit>&)> &window_done,
+                EfficiencyProbes *probes)
+{
+    // a track can only be duplicated within its window (the dedup key holds the
+    // triggerledge), so each window is monitored once its own tracks are deduplicated
+    EfficiencyProbes window_probes;
+    if (!probes && monitor) probes = &window_probes;
+    size_t window_start = out_rows.size();
+    auto finish_window = [&]() {
+        if (monitor) {
+            vector<SavedHit> rows(out_rows.begin() + window_start, out_rows.end());
+            global_dedup(rows, false);
+            MonitorHistograms mon_local;
+            mon_local.add_tracks(rows);
+            mon_local.add_probes(window_probes);
+            monitor->merge(mon_local);
+            window_probes.clear();
+        }
+        if (window_done) window_done(out_rows);
+        window_start = out_rows.size();
+    };
+
+    // Build index of triggerledge range
+    int trigger_min = INT_MAX, trigger_max = INT_MIN;
+    for (auto &h: all_hits) {
+        trigger_min = min(trigger_min, h.triggerledge);
+        trigger_max = max(trigger_max, h.triggerledge);
+    }
+    if (trigger_min==INT_MAX) return;
+    if (verbose) cout << "Triggerledge range: " << trigger_min << " .. " << trigger_max << "\n";
+
+    // windows
+    vector<int> windows;
+    for (int w=trigger_min; w<=trigger_max; w += WINDOW_SIZE) windows.push_back(w);
+    int win_i = 0;
+    for (int w0 : windows) {
+        ++win_i;
+        int w1 = w0 + WINDOW_SIZE;
+        if (verbose) cout << "\nProcessing window " << win_i << "/" << windows.size() << ": " << w0 << " - " << w1 << "\n";
+        vector<Hit> window_hits;
+        window_hits.reserve(4096);
+        for (auto &h: all_hits) if (h.triggerledge >= w0 && h.triggerledge < w1) window_hits.push_back(h);
+        if (rolling_mask) {
+            rolling_mask->push_window(window_hits);
+            rolling_mask->apply(window_hits);
+        }
+        if (window_hits.empty()) { if (verbose) cout << "  no hits\n"; continue; }
+
+        int saved = track_window(window_hits, out_rows, track_id, verbose, probes);
+        if (verbose) cout << "Window saved " << saved << " best tracks\n";
+        finish_window();
+    } // end windows
+}
+
+void global_dedup(vector<SavedHit> &out_rows, bool verbose)
+{
+    if (verbose) cout << "\nPerforming global final deduplication across all windows...\n";
+
+    struct TrackBundle {
+        vector<SavedHit> hits;   // the 6 hits
+        double chi2ndf;
+    };
+
+    unordered_map<int, TrackBundle> tracks_by_id;
+    tracks_by_id.reserve(out_rows.size()/6);
+
+    // Group hits by track_id
+    for (auto &h : out_rows) {
+        tracks_by_id[h.track_id].hits.push_back(h);
+    }
+
+    // Determine top key per track and find global best
+    unordered_map<string, TrackBundle> best_global_top;
+
+    for (auto &kv : tracks_by_id) {
+        int tid = kv.first;
+        auto &bundle = kv.second;
+
+        if (bundle.hits.size() != 6)
+            continue; // should never happen but safety
+
+        // Find the TOP hit (largest y)
+        const SavedHit* top_hit = &bundle.hits[0];
+        for (auto &h : bundle.hits) {
+            if (h.y > top_hit->y) top_hit = &h;
+        }
+
+        // Build canonical top key
+        string key = to_string(top_hit->TDCID) + "_" +
+                     to_string(top_hit->CHNLID) + "_" +
+                     to_string(top_hit->eventid) + "_" +
+                     to_string(top_hit->triggerledge);
+
+        // Find chi2ndf
+        double chi2ndf = bundle.hits[0].chi2ndf;
+
+        // Replace only if better
+        auto it = best_global_top.find(key);
+        if (it == best_global_top.end() || chi2ndf < it->second.chi2ndf) {
+            TrackBundle newb;
+            newb.hits = bundle.hits;
+            newb.chi2ndf = chi2ndf;
+            best_global_top[key] = std::move(newb);
+        }
+    }
+
+    // Rebuild out_rows
+    vector<SavedHit> filtered;
+    filtered.reserve(best_global_top.size() * 6);
+    for (auto &kv : best_global_top) {
+        for (auto &h : kv.second.hits) {
+            filtered.push_back(h);
+        }
+    }
+
+    if (verbose) {
+        cout << "Before global dedup: " << out_rows.size()/6 << " tracks\n";
+        cout << "After global dedup:  " << filtered.size()/6 << " tracks\n";
+    }
+
+    out_rows.swap(filtered);
+}
+
+// ------------------------------------------------------------
+// INCREMENTAL TRACKER
+// ------------------------------------------------------------
+MuonTracker::MuonTracker(const TrackerConfig &config) : config_(config) {
+    config_.n_workers = max(1u, config_.n_workers);
+    config_.max_queued_batches = max<size_t>(1, config_.max_queued_batches);
+    config_.event_batch = max(1, config_.event_batch);
+    for (unsigned t=0; t<config_.n_workers; ++t) workers_.emplace_back([this] { worker(); });
+}
+
+MuonTracker::~MuonTracker() { finish(); }
+
+void MuonTracker::push(const Hit &h) {
+    if (finished_) return;
+    builder_.push(h, pending_);
+    if ((int)pending_.size() >= config_.event_batch) enqueue_batch();
+}
+
+void MuonTracker::push_event(vector<Hit> hits) {
+    if (finished_ || hits.empty()) return;
+    pending_.push_back(std::move(hits));
+    if ((int)pending_.size() >= config_.event_batch) enqueue_batch();
+}
+
+void MuonTracker::flush() {
+    if (finished_) return;
+    builder_.flush(pending_);
+    if (!pending_.empty()) enqueue_batch();
+}
+
+bool MuonTracker::poll(vector<SavedHit> &rows) {
+    lock_guard<mutex> lock(done_mutex_);
+    if (done_rows_.empty()) return false;
+    if (rows.empty()) rows.swap(done_rows_);
+    else {
+        rows.insert(rows.end(), done_rows_.begin(), done_rows_.end());
+        done_rows_.clear();
+    }
+    return true;
+}
+
+void MuonTracker::finish() {
+    if (finished_) return;
+    flush();
+    finished_ = true;
+    {
+        lock_guard<mutex> lock(queue_mutex_);
+        finishing_ = true;
+    }
+    queue_ready_.notify_all();
+    for (auto &t : workers_) t.join();
+    workers_.clear();
+}
+
+// Hand the pending events to the workers, applying the channel mask first.
+// Blocks while the queue is full so decoding cannot outrun tracking without bound.
+void MuonTracker::enqueue_batch() {
+    vector<vector<Hit>> batch;
+    batch.swap(pending_);
+    if (config_.masker) {
+        if (config_.rolling_mask) {
+            vector<Hit> batch_hits;
+            for (auto &ev : batch) batch_hits.insert(batch_hits.end(), ev.begin(), ev.end());
+            config_.masker->push_window(batch_hits);
+        }
+        for (auto &ev : batch) config_.masker->apply(ev);
+    }
+    unique_lock<mutex> lock(queue_mutex_);
+    queue_space_.wait(lock, [&] { return queue_.size() < config_.max_queued_batches; });
+    queue_.push_back(std::move(batch));
+    queue_ready_.notify_one();
+}
+
+void MuonTracker::worker() {
+    for (;;) {
+        vector<vector<Hit>> batch;
+        {
+            unique_lock<mutex> lock(queue_mutex_);
+            queue_ready_.wait(lock, [&] { return finishing_ || !queue_.empty(); });
+            if (queue_.empty()) return;
+            batch = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        queue_space_.notify_one();
+
+        // track ids are local to the batch until the rows are published
+        vector<SavedHit> rows;
+        EfficiencyProbes probes;
+        int local_id = 0;
+        for (auto &ev : batch) {
+            // a 5-hit event can still probe the efficiency of its missing layer
+            if (ev.size() >= (config_.monitor ? 5u : 6u)) track_window(ev, rows, local_id, false, config_.monitor ? &probes : nullptr, 16);
+        }
+        global_dedup(rows, false);
+        if (config_.monitor) {
+            MonitorHistograms mon_local;
+            mon_local.add_tracks(rows);
+            mon_local.add_probes(probes);
+            config_.monitor->merge(mon_local);
+        }
+
+        lock_guard<mutex> lock(done_mutex_);
+        for (auto &r : rows) r.track_id += next_track_id_;
+        next_track_id_ += local_id;
+        n_tracks_ += rows.size() / 6;
+        done_rows_.insert(done_rows_.end(), rows.begin(), rows.end());
+    }
+}
+
+// ------------------------------------------------------------
+// OUTPUT
+// ------------------------------------------------------------
+TrackWriter::TrackWriter(const string &path, Format format) : format_(format) {
+    file_ = fopen(path.c_str(), "wb");
+    if (!file_) return;
+    setvbuf(file_, nullptr, _IONBF, 0);
+    buf_.reserve(OUT_BUFFER_SIZE + 4096);
+    if (format_ == Format::CSV) {
+        append("track_id,TDCID,CHNLID,eventid,drift_time,corr_time,adc_time,triggerledge,Dt,x,y,drift_radius,residual,a,b,c,chi2ndf\n");
+    } else {
+        BinFileHeader hdr = {{'M','D','T','T','R','K',0,0}, 1, (uint32_t)sizeof(BinHitRecord)};
+        append_raw(&hdr, sizeof(hdr));
+    }
+    thread_ = thread([this] { run(); });
+}
+
+TrackWriter::~TrackWriter() { close(); }
+
+bool TrackWriter::write(vector<SavedHit> rows) {
+    if (!is_open()) return false; // no writer thread to drain the queue
+    if (rows.empty()) return true;
+    unique_lock<mutex> lock(mutex_);
+    space_.wait(lock, [&] { return queue_.size() < MAX_QUEUED_BATCHES; });
+    queue_.push_back(std::move(rows));
+    ready_.notify_one();
+    return true;
+}
+
+void TrackWriter::sync() {
+    if (!is_open()) return;
+    {
+        lock_guard<mutex> lock(mutex_);
+        sync_ = true;
+    }
+    ready_.notify_one();
+}
+
+bool TrackWriter::close() {
+    if (!file_) return false;
+    {
+        lock_guard<mutex> lock(mutex_);
+        done_ = true;
+    }
+    ready_.notify_one();
+    if (thread_.joinable()) thread_.join();
+    flush();
+    if (fclose(file_) != 0) failed_ = true;
+    file_ = nullptr;
+    return !failed_;
+}
+
+void TrackWriter::run() {
+    for (;;) {
+        vector<SavedHit> rows;
+        {
+            unique_lock<mutex> lock(mutex_);
+            ready_.wait(lock, [&] { return done_ || sync_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                if (done_) return;
+                // sync once the rows queued before it are formatted
+                sync_ = false;
+                lock.unlock();
+                flush();
+                continue;
+            }
+            rows = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        space_.notify_one();
+        if (format_ == Format::CSV) format_csv(rows);
+        else format_bin(rows);
+        rows_written_ += rows.size();
+    }
+}
+
+void TrackWriter::format_csv(const vector<SavedHit> &rows) {
+    for (auto &r : rows) {
+        append_int(r.track_id); put(',');
+        append_int(r.TDCID); put(',');
+        append_int(r.CHNLID); put(',');
+        append_int(r.eventid); put(',');
+        // the ofstream writer only switched to std::fixed after the first row,
+        // so the first row's times were printed in the default format
+        auto fmt_time = first_row_ ? chars_format::general : chars_format::fixed;
+        append_double(r.drift_time, fmt_time); put(',');
+        append_double(r.corr_time, fmt_time); put(',');
+        append_double(r.adc_time, fmt_time); put(',');
+        first_row_ = false;
+        append_int(r.triggerledge); put(',');
+        append_double(r.Dt); put(',');
+        append_double(r.x); put(',');
+        append_double(r.y); put(',');
+        append_double(r.drift_radius); put(',');
+        append_double(r.residual); put(',');
+        append_double(r.a); put(',');
+        append_double(r.b); put(',');
+        append_double(r.c); put(',');
+        append_double(r.chi2ndf); put('\n');
+        if (buf_.size() >= OUT_BUFFER_SIZE) flush();
+    }
+}
+
+void TrackWriter::format_bin(const vector<SavedHit> &rows) {
+    for (size_t i=0; i<rows.size(); ) {
+        size_t j = i;
+        while (j < rows.size() && rows[j].track_id == rows[i].track_id) ++j;
+        const SavedHit &t = rows[i];
+        BinTrackRecord tr = {t.track_id, (uint32_t)(j-i), t.a, t.b, t.c, t.chi2ndf};
+        append_raw(&tr, sizeof(tr));
+        for (; i<j; ++i) {
+            const SavedHit &r = rows[i];
+            BinHitRecord hr = {r.TDCID, r.CHNLID, r.eventid, r.triggerledge,
+                               r.drift_time, r.corr_time, r.adc_time, r.Dt,
+                               r.x, r.y, r.drift_radius, r.residual};
+            append_raw(&hr, sizeof(hr));
+        }
+        if (buf_.size() >= OUT_BUFFER_SIZE) flush();
+    }
+}
+
+void TrackWriter::append_int(int v) {
+    char tmp[16];
+    auto res = to_chars(tmp, tmp + sizeof(tmp), v);
+    buf_.append(tmp, res.ptr);
+}
+
+void TrackWriter::append_double(double v, chars_format fmt) {
+    char tmp[512];
+    auto res = to_chars(tmp, tmp + sizeof(tmp), v, fmt, 6);
+    buf_.append(tmp, res.ptr);
+}
+
+void TrackWriter::flush() {
+    if (buf_.empty() || !file_) return;
+    if (fwrite(buf_.data(), 1, buf_.size(), file_) != buf_.size()) failed_ = true;
+    buf_.clear();
+}
+
+// ------------------------------------------------------------
+// BATCH MODE
+// ------------------------------------------------------------
+vector<string> collect_chunks(const string &spec)
+{
+    static const regex chunk_re(R"(hits_(\d+)(_with_radius)?\.csv)");
+    auto chunk_index = [](const string &path)->long {
+        string name = filesystem::path(path).filename().string();
+        smatch m;
+        if (regex_search(name, m, regex(R"((\d+))"))) return stol(m[1]);
+        return -1;
+    };
+
+    vector<string> files;
+    if (filesystem::is_directory(spec)) {
+        map<long, string> by_index;
+        for (auto &entry : filesystem::directory_iterator(spec)) {
+            string name = entry.path().filename().string();
+            smatch m;
+            if (!regex_match(name, m, chunk_re)) continue;
+            long n = stol(m[1]);
+            if (m[2].matched || !by_index.count(n)) by_index[n] = entry.path().string();
+        }
+        for (auto &kv : by_index) files.push_back(kv.second);
+        return files;
+    }
+
+    glob_t g;
+    if (glob(spec.c_str(), 0, nullptr, &g) == 0) {
+        for (size_t i=0; i<g.gl_pathc; ++i) files.push_back(g.gl_pathv[i]);
+    }
+    globfree(&g);
+    stable_sort(files.begin(), files.end(), [&](const string &l, const string &r) {
+        return chunk_index(l) < chunk_index(r);
+    });
+    return files;
+}
+
+bool count_occupancy(const vector<string> &chunks, ChannelMasker &masker, unsigned n_threads)
+{
+    atomic<size_t> next_chunk{0};
+    atomic<bool> ok{true};
+    auto worker = [&]() {
+        for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+            vector<Hit> hits;
+            if (!load_hits_csv(chunks[i], hits)) { ok = false; continue; }
+            masker.count(hits);
+        }
+    };
+    n_threads = max(1u, min<unsigned>(n_threads, chunks.size()));
+    cout << "Counting channel occupancy over " << chunks.size() << " chunks\n";
+    vector<thread> pool;
+    for (unsigned t=0; t<n_threads; ++t) pool.emplace_back(worker);
+    for (auto &t : pool) t.join();
+    return ok;
+}
+
+// Events are complete within a batch of the tracker, so nothing is carried over the seams
+// and the rows need no further deduplication. The chunks are parsed ahead on a pool of
+// loader threads (at most `n_threads` chunks ahead) and pushed to the tracker in order.
+static bool run_batch_events(const vector<string> &chunks, vector<SavedHit> &out_rows, unsigned n_threads,
+                             Monitor *monitor, ChannelMasker *masker,
+                             const function<void(vector<SavedHit>&)> &chunk_done)
+{
+    struct LoadedChunk {
+        vector<Hit> hits;
+        bool done = false;
+        bool ok = false;
+    };
+    vector<LoadedChunk> loaded(chunks.size());
+    const size_t read_ahead = max(1u, n_threads);
+    size_t next_load = 0, consumed = 0;
+    bool stop = false;
+    mutex load_mutex;
+    condition_variable load_ready, load_space;
+
+    auto loader = [&]() {
+        for (;;) {
+            size_t i;
+            {
+                unique_lock<mutex> lock(load_mutex);
+                load_space.wait(lock, [&] { return stop || next_load >= chunks.size() || next_load < consumed + read_ahead; });
+                if (stop || next_load >= chunks.size()) return;
+                i = next_load++;
+            }
+            vector<Hit> hits;
+            bool ok = load_hits_csv(chunks[i], hits);
+            {
+                lock_guard<mutex> lock(load_mutex);
+                loaded[i].hits.swap(hits);
+                loaded[i].ok = ok;
+                loaded[i].done = true;
+            }
+            load_ready.notify_all();
+        }
+    };
+
+    TrackerConfig config;
+    config.n_workers = n_threads;
+    config.monitor = monitor;
+    config.masker = masker;
+    MuonTracker tracker(config);
+    cout << "Processing " << chunks.size() << " chunks on " << config.n_workers << " threads\n";
+    vector<thread> pool;
+    for (size_t t=0; t<min(read_ahead, chunks.size()); ++t) pool.emplace_back(loader);
+    auto join_loaders = [&]() {
+        {
+            lock_guard<mutex> lock(load_mutex);
+            stop = true;
+        }
+        load_space.notify_all();
+        for (auto &t : pool) t.join();
+    };
+
+    for (size_t i=0; i<chunks.size(); ++i) {
+        vector<Hit> hits;
+        bool ok;
+        {
+            unique_lock<mutex> lock(load_mutex);
+            load_ready.wait(lock, [&] { return loaded[i].done; });
+            hits.swap(loaded[i].hits);
+            ok = loaded[i].ok;
+            consumed = i+1;
+        }
+        load_space.notify_all();
+        if (!ok) {
+            cerr << "Chunk " << chunks[i] << " failed\n";
+            join_loaders();
+            return false;
+        }
+        for (auto &h : hits) tracker.push(h);
+        if (!chunk_done) tracker.poll(out_rows);
+        else {
+            vector<SavedHit> rows;
+            if (tracker.poll(rows)) chunk_done(rows);
+        }
+        cout << "Chunk " << (i+1) << "/" << chunks.size() << " " << chunks[i] << ": " << hits.size() << " hits\n";
+    }
+    join_loaders();
+    tracker.finish();
+    if (!chunk_done) tracker.poll(out_rows);
+    else {
+        vector<SavedHit> rows;
+        if (tracker.poll(rows)) chunk_done(rows);
+    }
+    cout << "Tracked " << tracker.n_tracks() << " tracks\n";
+    return true;
+}
+
+bool run_batch(const vector<string> &chunks, vector<SavedHit> &out_rows, unsigned n_threads,
+               bool event_mode, Monitor *monitor, ChannelMasker *masker,
+               const function<void(vector<SavedHit>&)> &chunk_done)
+{
+    if (event_mode) return run_batch_events(chunks, out_rows, n_threads, monitor, masker, chunk_done);
+
+    struct ChunkResult {
+        vector<SavedHit> rows;
+        vector<size_t> window_ends;                 // end of each window in rows
+        EfficiencyProbes probes;                    // of the window being tracked
+        vector<EfficiencyProbes> window_probes;
+        int n_tracks = 0;
+        bool done = false;
+        bool ok = false;
+    };
+    vector<ChunkResult> results(chunks.size());
+    atomic<size_t> next_chunk{0};
+    mutex log_mutex;
+    mutex done_mutex;
+    condition_variable chunk_ready;
+
+    auto worker = [&]() {
+        for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+            auto &res = results[i];
+            vector<Hit> hits;
+            if (load_hits_csv(chunks[i], hits)) {
+                size_t own = hits.size();
+
+                // carry the overlapping triggerledge range from the head of the next chunk
+                if (i+1 < chunks.size() && !hits.empty()) {
+                    int seam = hits.back().triggerledge;
+                    load_hits_csv(chunks[i+1], hits, [&](const Hit &h) {
+                        return abs(rollover_bindiff_cal(h.triggerledge, seam, ROLLOVER)) <= WINDOW_SIZE;
+                    });
+                }
+
+                size_t carried = hits.size() - own;
+                size_t removed = masker ? masker->apply(hits, own) : 0;
+
+                track_hits(hits, res.rows, res.n_tracks, false, nullptr, nullptr, [&](vector<SavedHit> &rows) {
+                    res.window_ends.push_back(rows.size());
+                    if (monitor) res.window_probes.push_back(std::move(res.probes));
+                    res.probes.clear();
+                }, monitor ? &res.probes : nullptr);
+                res.ok = true;
+
+                lock_guard<mutex> lock(log_mutex);
+                cout << "Chunk " << (i+1) << "/" << chunks.size() << " " << chunks[i] << ": "
+                     << own << " hits (+" << carried << " carried, -" << removed << " masked), "
+                     << res.n_tracks << " tracks\n";
+            }
+            {
+                lock_guard<mutex> lock(done_mutex);
+                res.done = true;
+            }
+            chunk_ready.notify_all();
+        }
+    };
+
+    n_threads = max(1u, min<unsigned>(n_threads, chunks.size()));
+    cout << "Processing " << chunks.size() << " chunks on " << n_threads << " threads\n";
+    vector<thread> pool;
+    for (unsigned t=0; t<n_threads; ++t) pool.emplace_back(worker);
+
+    // Chunks are settled in order. A track near a seam is found by both neighbouring
+    // chunks, so chunk i-1 is final once chunk i is done: the duplicates are dropped by
+    // deduplicating the two together, then chunk i-1 is monitored and output window
+    // by window. Track ids are shifted to stay unique across chunks.
+    unordered_set<int> dropped;
+    size_t n_found = 0, n_kept = 0;
+    int id_offset = 0;
+    auto settle = [&](ChunkResult &res) {
+        vector<SavedHit> chunk_rows;
+        vector<SavedHit> &dest = chunk_done ? chunk_rows : out_rows;
+        size_t begin = 0;
+        for (size_t w=0; w<res.window_ends.size(); ++w) {
+            vector<SavedHit> rows;
+            for (size_t r=begin; r<res.window_ends[w]; ++r) {
+                if (!dropped.count(res.rows[r].track_id)) rows.push_back(res.rows[r]);
+            }
+            begin = res.window_ends[w];
+            if (monitor) {
+                MonitorHistograms mon_local;
+                mon_local.add_tracks(rows);
+                mon_local.add_probes(res.window_probes[w]);
+                monitor->merge(mon_local);
+            }
+            n_kept += rows.size() / 6;
+            dest.insert(dest.end(), rows.begin(), rows.end());
+        }
+        if (chunk_done && !chunk_rows.empty()) chunk_done(chunk_rows);
+        res = ChunkResult();
+    };
+
+    bool ok = true;
+    for (size_t i=0; i<results.size(); ++i) {
+        auto &res = results[i];
+        {
+            unique_lock<mutex> lock(done_mutex);
+            chunk_ready.wait(lock, [&] { return res.done; });
+        }
+        if (!res.ok) {
+            cerr << "Chunk " << chunks[i] << " failed\n";
+            next_chunk = chunks.size();
+            ok = false;
+            break;
+        }
+        for (auto &r : res.rows) r.track_id += id_offset;
+        id_offset += res.n_tracks;
+        n_found += res.rows.size() / 6;
+
+        vector<SavedHit> both;
+        if (i > 0) {
+            auto &prev = results[i-1];
+            for (auto &r : prev.rows) if (!dropped.count(r.track_id)) both.push_back(r);
+
+            // a seam probe counts once, as seen by chunk i-1, which also had the carried hits
+            unordered_map<string_view, EfficiencyProbe*> index;
+            for (auto &wp : res.window_probes)
+                for (auto &kv : wp) index.emplace(kv.first, &kv.second);
+            for (auto &wp : prev.window_probes) {
+                for (auto it = wp.begin(); it != wp.end();) {
+                    auto hit = index.find(it->first);
+                    if (hit == index.end()) { ++it; continue; }
+                    *hit->second = it->second;
+                    it = wp.erase(it);
+                }
+            }
+        }
+        both.insert(both.end(), res.rows.begin(), res.rows.end());
+        size_t n_before = both.size() / 6;
+        unordered_set<int> before;
+        for (size_t r=0; r<both.size(); r+=6) before.insert(both[r].track_id);
+        global_dedup(both, false);
+        if (both.size() / 6 < n_before) {
+            for (size_t r=0; r<both.size(); r+=6) before.erase(both[r].track_id);
+            dropped.insert(before.begin(), before.end());
+        }
+        if (i > 0) settle(results[i-1]);
+    }
+    for (auto &t : pool) t.join();
+    if (!ok) return false;
+    if (!results.empty()) settle(results.back());
+
+    cout << "\nSeam and window deduplication: " << n_found << " -> " << n_kept << " tracks\n";
+    return true;
+}
+
+} // namespace MDTTracking
@@ -0,0 +1,466 @@
+// muon_tracker.h
+// Tracking library behind muon_tracker_fixed: finds perpendicular 6-hit tracks in
+// TDC pairs (mezzanines) of the MDT chamber. It can be run over whole hit files
+// (track_hits, run_batch) or fed incrementally through MuonTracker, which is how
+// RecoUtility hands over the hits of each decoded event in memory.
+//
+// Compile together with muon_tracker.cpp (C++17, -pthread).
+
+#ifndef MDT_MUON_TRACKER_H
+#define MDT_MUON_TRACKER_H
+
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace MDTTracking {
+
+struct Hit {
+    int TDCID;
+    int CHNLID;
+    int eventid;
+    int triggerledge;
+    double drift_time;
+    double adc_time;
+    double corr_time;
+    double drift_radius; // mm
+};
+
+struct SavedHit {
+    int track_id;
+    int TDCID;
+    int CHNLID;
+    int eventid;
+    int triggerledge;
+    double adc_time;
+    double drift_time;
+    double corr_time;
+    double Dt;
+    double x;
+    double y;
+    double drift_radius;
+    double residual;
+    double a,b,c;
+    double chi2ndf;
+};
+
+// ---------- geometry ----------
+using Point = std::pair<double,double>;
+
+// hits of one window / event, by TDCID and CHNLID
+using ChannelHitMap = std::unordered_map<int, std::unordered_map<int, std::vector<const Hit*>>>;
+
+static const int WINDOW_SIZE = 2000;
+static const double CHI2NDF_CUT = 50.0;
+static const double TUBE_INNER_RADIUS = 14.6; // mm
+static const double EFF_RADIUS_TOLERANCE = 2.0; // mm, |drift radius - track distance| for a found hit
+
+static const int ROLLOVER = 131072;             // 17-bit TDC ledge / triggerledge counter
+static const int EVENT_TRIGGER_TOLERANCE = 64;  // bins between hits of one trigger (rollover-aware)
+static const int EVENT_REORDER_DEPTH = 8;       // open events before the oldest one is closed
+static const int EVENT_BATCH = 256;             // events handed to the candidate search at once
+
+// Tube centres (mm) per TDC and channel, built once from the mezzanine layout.
+const std::vector<std::array<Point,24>> &tdc_geometry();
+
+// same as RecoUtility::rollover_bindiff_cal
+int rollover_bindiff_cal(int a, int b, int rollover);
+
+// Parse a hits CSV into `out`. If `keep_reading` is given, reading stops at the
+// first hit it rejects (that hit is not stored).
+bool load_hits_csv(const std::string &path, std::vector<Hit> &out,
+                   const std::function<bool(const Hit&)> &keep_reading = nullptr);
+
+// ------------------------------------------------------------
+// RT RELATION: drift time -> drift radius
+// ------------------------------------------------------------
+// Linear interpolation of the r(t) table written by rt_rel_mon.py (rt_tree with
+// time_ns, radius_mm), evaluated at drift_time - t0 and clamped to the table ends.
+class RTRelation {
+public:
+    RTRelation(std::vector<double> time_ns, std::vector<double> radius_mm, double t0);
+    double radius(double drift_time) const;
+    bool empty() const { return time_.empty(); }
+
+private:
+    std::vector<double> time_;
+    std::vector<double> radius_;
+    double t0_;
+};
+
+// ------------------------------------------------------------
+// HOT / NOISY CHANNEL MASKING before pattern recognition
+// ------------------------------------------------------------
+// A tube whose occupancy exceeds HOT_FACTOR times the median occupancy of all
+// tubes with hits (and at least HOT_MIN_HITS hits) is flagged. Flagged tubes are
+// either masked (all hits dropped) or have afterpulse bursts collapsed: a hit in
+// the same tube, eventid and triggerledge within DEAD_TIME ns of the previously
+// kept hit is dropped. Every decision is logged and can be saved to / loaded
+// from a mask file with lines "TDCID,CHNLID,action,hits,ratio".
+// All members lock, so chunks can be counted and masked from several threads.
+class ChannelMasker {
+public:
+    enum class Action { NONE, MASK, COLLAPSE };
+
+    struct Decision {
+        Action action = Action::NONE;
+        uint64_t hits = 0;
+        double ratio = 0.0;
+    };
+
+    ChannelMasker(Action action, double hot_factor, uint64_t min_hits, double dead_time, int horizon);
+
+    static int key(int tdc, int ch) { return tdc * 64 + ch; }
+
+    // run-wide pre-pass
+    void count(const std::vector<Hit> &hits);
+
+    // streaming mode: occupancy over the last `horizon` windows, re-evaluated per window
+    void push_window(const std::vector<Hit> &hits);
+
+    // Flag outliers of the current occupancy, logging every change of decision.
+    void decide();
+
+    // Drop masked hits and collapse afterpulse bursts in place. Returns the number of hits
+    // removed from the first `n_own` hits, the only ones added to removed(); the rest are
+    // hits carried over a chunk seam, which are counted with their own chunk.
+    size_t apply(std::vector<Hit> &hits, size_t n_own = SIZE_MAX);
+
+    bool load(const std::string &path);
+    bool save(const std::string &path) const;
+
+    size_t n_flagged() const { std::lock_guard<std::mutex> lock(mutex_); return flagged_.size(); }
+    uint64_t removed() const { return removed_; }
+
+private:
+    static const char *action_name(Action a);
+    void log_decision(int k, const Decision &d, double median) const;
+    void decide_locked();
+
+    Action action_;
+    double hot_factor_;
+    uint64_t min_hits_;
+    double dead_time_;
+    int horizon_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<int, uint64_t> counts_;
+    std::deque<std::unordered_map<int, uint64_t>> history_;
+    std::map<int, Decision> decisions_;
+    std::map<int, Decision> flagged_;
+    std::atomic<uint64_t> removed_{0};
+};
+
+// ------------------------------------------------------------
+// ONLINE MONITORING: tube efficiency, residual vs radius, chi2/ndf
+// ------------------------------------------------------------
+// Tube efficiency is measured one layer at a time: a candidate fitted to hits in the
+// other 5 layers of a TDC pair predicts the tube it crosses in the left-out test layer
+// (tube = TDCID*N_CH + CHNLID). That tube is `found` if it has a hit of the same trigger
+// (eventid and triggerledge of the candidate's top hit) whose drift radius matches the
+// predicted distance within EFF_RADIUS_TOLERANCE.
+struct EfficiencyProbe {
+    int tube;
+    bool found;
+    double chi2ndf;
+};
+// best probe per top hit and test layer, keyed like the track deduplication
+using EfficiencyProbes = std::unordered_map<std::string, EfficiencyProbe>;
+
+// Keep the better of two probes with the same key.
+void merge_probe(EfficiencyProbes &probes, const std::string &key, const EfficiencyProbe &p);
+
+// Monitoring observables of the final (deduplicated) tracks. Each tracking thread
+// fills its own copy and merges it into the shared Monitor after every window.
+struct MonitorHistograms {
+    static const int N_TDC = 18;
+    static const int N_CH = 24;
+    static constexpr int R_BINS = 30;      // drift radius 0 .. 15 mm
+    static constexpr double R_MAX = 15.0;
+    static constexpr int RES_BINS = 100;   // residual -2.5 .. 2.5 mm
+    static constexpr double RES_MAX = 2.5;
+    static constexpr int CHI2_BINS = 100;  // chi2/ndf 0 .. CHI2NDF_CUT
+
+    // test-layer tubes predicted by 5-layer candidates and how many had a matching hit
+    std::array<uint64_t, N_TDC*N_CH> expected{};
+    std::array<uint64_t, N_TDC*N_CH> found{};
+    std::array<uint64_t, R_BINS*RES_BINS> res_vs_r{};
+    std::array<uint64_t, R_BINS> res_n{};
+    std::array<double, R_BINS> res_sum{};
+    std::array<double, R_BINS> res_sum2{};
+    std::array<uint64_t, CHI2_BINS> chi2ndf{};
+    uint64_t n_tracks = 0;
+
+    // Fill the tracks in `rows` (6 contiguous rows per track).
+    void add_tracks(const std::vector<SavedHit> &rows);
+    void add_probes(const EfficiencyProbes &probes);
+    void add(const MonitorHistograms &o);
+};
+
+// Shared monitoring state. Every `every` merged windows a snapshot is written to
+// <prefix>_tubes.csv, <prefix>_resolution.csv and <prefix>_chi2ndf.csv (overwritten each time).
+class Monitor {
+public:
+    Monitor(const std::string &prefix, int every);
+
+    // Merge a thread's window accumulator and reset it.
+    void merge(MonitorHistograms &local);
+    // Write a snapshot unless nothing was merged since the last one.
+    void snapshot();
+    int snapshots();
+
+private:
+    void write_snapshot();
+
+    std::string prefix_;
+    int every_;
+    std::mutex mutex_;
+    MonitorHistograms total_;
+    int windows_ = 0;
+    int snapshots_ = 0;
+    int snapshot_windows_ = -1; // windows_ at the last snapshot
+};
+
+// ------------------------------------------------------------
+// EVENT BUILDER: group hits by eventid with triggerledge rollover handling
+// ------------------------------------------------------------
+// Incremental event builder. A hit joins an open event with the same eventid whose
+// triggerledge is within EVENT_TRIGGER_TOLERANCE (modulo ROLLOVER); otherwise it
+// opens a new event, so eventid wrap-around starts a new event. Events are closed
+// in arrival order once more than EVENT_REORDER_DEPTH are open.
+class EventBuilder {
+public:
+    void push(const Hit &h, std::vector<std::vector<Hit>> &done);
+    void flush(std::vector<std::vector<Hit>> &done);
+
+private:
+    struct OpenEvent {
+        int eventid;
+        int triggerledge;
+        std::vector<Hit> hits;
+    };
+    std::deque<OpenEvent> open_;
+};
+
+// ------------------------------------------------------------
+// TRACK FINDING
+// ------------------------------------------------------------
+// Two-iteration candidate search over the hits of one window (or event), appending
+// 6 rows per best track to `out_rows`. Returns the number of tracks saved.
+// With `probes`, the efficiency probes of the window are collected as well.
+// `best_buckets` sizes the best-fit map: large for windows, small for single events.
+int track_window(const std::vector<Hit> &window_hits, std::vector<SavedHit> &out_rows,
+                 int &track_id, bool verbose, EfficiencyProbes *probes,
+                 size_t best_buckets = 2048);
+
+// Run the candidate search over `all_hits`, appending 6 rows per best track to
+// `out_rows`. Track ids continue from `track_id`. Hits are grouped into fixed
+// WINDOW_SIZE triggerledge windows; events built from eventid are tracked by MuonTracker.
+// `window_done`, if given, is called with `out_rows` after every window (streaming mode).
+// With a `monitor`, the tracks surviving deduplication are accumulated per window for
+// online monitoring. With `probes`, the efficiency probes are returned instead, for
+// callers that deduplicate (and monitor) later.
+// A `rolling_mask` judges channel occupancy over its horizon of windows and filters each window.
+void track_hits(const std::vector<Hit> &all_hits, std::vector<SavedHit> &out_rows,
+                int &track_id, bool verbose, Monitor *monitor = nullptr,
+                ChannelMasker *rolling_mask = nullptr,
+                const std::function<void(std::vector<SavedHit>&)> &window_done = nullptr,
+                EfficiencyProbes *probes = nullptr);
+
+// FINAL GLOBAL DEDUPLICATION: ensure only one best track per top hit.
+// The top key carries the triggerledge, so all tracks competing for a key come
+// from the same window; streaming mode therefore applies this per window.
+void global_dedup(std::vector<SavedHit> &out_rows, bool verbose = true);
+
+// ------------------------------------------------------------
+// INCREMENTAL TRACKER: push hits, poll finished tracks
+// ------------------------------------------------------------
+struct TrackerConfig {
+    unsigned n_workers = 2;
+    size_t max_queued_batches = 64;    // bounded queue between the producer and the workers
+    int event_batch = EVENT_BATCH;
+    Monitor *monitor = nullptr;        // optional online monitoring
+    ChannelMasker *masker = nullptr;   // optional channel mask applied to every batch
+    bool rolling_mask = false;         // masker also learns occupancy over its horizon of batches
+};
+
+// Builds events from pushed hits and runs the candidate search on worker threads.
+// push / push_event / flush must be called from one producer thread; they block
+// while max_queued_batches batches are waiting. Finished tracks are deduplicated
+// per batch, numbered globally and collected until poll() takes them.
+class MuonTracker {
+public:
+    explicit MuonTracker(const TrackerConfig &config = TrackerConfig());
+    ~MuonTracker();
+
+    MuonTracker(const MuonTracker&) = delete;
+    MuonTracker &operator=(const MuonTracker&) = delete;
+
+    // Add one hit; the event builder decides which event it belongs to.
+    void push(const Hit &h);
+    // Add the complete hit list of one event, bypassing the event builder.
+    void push_event(std::vector<Hit> hits);
+    // Close all open events and hand the partial batch to the workers.
+    void flush();
+    // Move the rows of all finished tracks to the end of `rows`. Returns true if any were added.
+    bool poll(std::vector<SavedHit> &rows);
+    // Flush and wait until every queued batch is tracked. Further pushes are ignored.
+    void finish();
+
+    size_t n_tracks() const { return n_tracks_; }
+
+private:
+    void enqueue_batch();
+    void worker();
+
+    TrackerConfig config_;
+    EventBuilder builder_;
+    std::vector<std::vector<Hit>> pending_;
+
+    std::mutex queue_mutex_;
+    std::condition_variable queue_ready_, queue_space_;
+    std::deque<std::vector<std::vector<Hit>>> queue_;
+    bool finishing_ = false;
+
+    std::mutex done_mutex_;
+    std::vector<SavedHit> done_rows_;
+    int next_track_id_ = 0;
+    std::atomic<size_t> n_tracks_{0};
+
+    std::vector<std::thread> workers_;
+    bool finished_ = false;
+};
+
+// ------------------------------------------------------------
+// OUTPUT: buffered CSV / binary track writer running on its own thread
+// ------------------------------------------------------------
+// CSV rows are formatted with to_chars into a large buffer that is flushed with
+// one fwrite per OUT_BUFFER_SIZE bytes. The columns and number formatting match
+// the original ofstream writer byte for byte.
+//
+// The binary format (--format bin) is a header followed by one record per track
+// and that track's hit records:
+//   BinFileHeader
+//   { BinTrackRecord, BinHitRecord x n_hits } per track
+// All fields are little-endian as written by the host.
+struct BinFileHeader {
+    char magic[8];          // "MDTTRK\0\0"
+    uint32_t version;       // 1
+    uint32_t hit_size;      // sizeof(BinHitRecord)
+};
+
+struct BinTrackRecord {
+    int32_t track_id;
+    uint32_t n_hits;
+    double a,b,c;
+    double chi2ndf;
+};
+
+struct BinHitRecord {
+    int32_t TDCID;
+    int32_t CHNLID;
+    int32_t eventid;
+    int32_t triggerledge;
+    double drift_time;
+    double corr_time;
+    double adc_time;
+    double Dt;
+    double x;
+    double y;
+    double drift_radius;
+    double residual;
+};
+
+class TrackWriter {
+public:
+    enum class Format { CSV, BIN };
+
+    static const size_t OUT_BUFFER_SIZE = 1 << 22;
+    static const size_t MAX_QUEUED_BATCHES = 64;
+
+    TrackWriter(const std::string &path, Format format);
+    ~TrackWriter();
+
+    bool is_open() const { return file_ != nullptr; }
+
+    // Queue rows for writing. Rows of one track must be contiguous and in the same batch.
+    // Returns false (dropping the rows) if the file is not open.
+    bool write(std::vector<SavedHit> rows);
+
+    // Write out everything queued so far without closing the file; otherwise the
+    // buffer only reaches the disk when it is full.
+    void sync();
+
+    // Drain the queue, flush and close the file. Returns false on any write error.
+    bool close();
+
+    size_t rows_written() const { return rows_written_; }
+
+private:
+    void run();
+    void format_csv(const std::vector<SavedHit> &rows);
+    void format_bin(const std::vector<SavedHit> &rows);
+
+    void put(char c) { buf_.push_back(c); }
+    void append(const char *s) { buf_.append(s); }
+    void append_raw(const void *p, size_t n) { buf_.append((const char*)p, n); }
+    void append_int(int v);
+    // precision 6 in either format, as setprecision(6) did
+    void append_double(double v, std::chars_format fmt = std::chars_format::fixed);
+    void flush();
+
+    Format format_;
+    FILE *file_ = nullptr;
+    std::string buf_;
+    bool first_row_ = true;
+    bool failed_ = false;
+    std::atomic<size_t> rows_written_{0};
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable ready_, space_;
+    std::deque<std::vector<SavedHit>> queue_;
+    bool sync_ = false;
+    bool done_ = false;
+};
+
+// ------------------------------------------------------------
+// BATCH MODE over the hits_N.csv chunks of a run
+// ------------------------------------------------------------
+// Resolve a run directory (hits_N.csv / hits_N_with_radius.csv, the latter preferred)
+// or a glob pattern into the list of chunk files, ordered by chunk index N.
+std::vector<std::string> collect_chunks(const std::string &spec);
+
+// Run-wide occupancy pre-pass over all chunks for the channel masker.
+bool count_occupancy(const std::vector<std::string> &chunks, ChannelMasker &masker, unsigned n_threads);
+
+// Track every chunk on a pool of worker threads and merge the deduplicated results into
+// `out_rows` in chunk order. A chunk is settled as soon as its successor is done; its
+// windows are then merged into the monitor one by one.
+// Each chunk also receives the leading hits of the next chunk that fall within
+// WINDOW_SIZE of its last triggerledge, so tracks crossing a chunk seam are found;
+// the duplicates this creates are removed by the global deduplication on the merged output.
+// With `event_mode` the chunks are instead fed in order to one MuonTracker, whose event
+// builder joins the events split by a seam.
+// `chunk_done`, if given, receives the rows of every settled chunk instead of `out_rows`
+// (streaming mode).
+bool run_batch(const std::vector<std::string> &chunks, std::vector<SavedHit> &out_rows, unsigned n_threads,
+               bool event_mode, Monitor *monitor, ChannelMasker *masker,
+               const std::function<void(std::vector<SavedHit>&)> &chunk_done = nullptr);
+
+} // namespace MDTTracking
+
+#endif